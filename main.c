@@ -1,5 +1,5 @@
 /* Author: Leif Brockman, 664734715, lbroc3@uis.edu
-    Compile: gcc main.c -o shell.out
+    Compile: gcc main.c -o shell.out -pthread
 
     Brief Description: A simple command line interpretter; it takes
 	a single command and parameters and executes
@@ -18,55 +18,310 @@
     Commands are displayed including their occurrence rate when
     mfu is entered.  These are stored between sessions in a file
     occurrence.txt in the same location as the shell.out file.
+
+    Both files are written atomically: the contents go to a temporary
+    file behind a checksummed header, are fsync'd, and then renamed over
+    the original.  The previous good copy is kept as <file>.bak and is
+    used to recover if the main file is found to be corrupt on startup.
+
+    Input lines may be of any length and may contain NUL bytes.  Stored
+    commands are interned once in a string arena and shared between the
+    history and the occurrence records.  End of input behaves like exit,
+    so a file of commands can be fed to the shell on stdin.
+
+    Setting CMDLINE_METRICS_SOCKET to a path (%p is replaced by the pid)
+    serves counters in the Prometheus text format on that Unix socket
+    from a background thread, e.g.
+        curl --unix-socket /tmp/shell.sock http://localhost/metrics
+
+    Variables are set with export NAME=VALUE and removed with unset NAME.
+    Children get an environment snapshot that is only rebuilt after a
+    variable changes, so back to back commands share one envp array.
 */
 
 
+#define _GNU_SOURCE /* accept4 */
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
-
-#define MAX_LINE 80 /* The maximum length command */
-#define MAX_ARGS 10 /* The maximum number of arguments */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <dirent.h>
+
+#define MAX_LINE 80 /* The command length in occurrence files before version 2 */
+#define MAX_ARGS 10 /* The initial number of arguments room is made for */
 #define MAX_HISTORY 10 /*The maximum number of commands to store in history */
 
+#define READ_CHUNK 65536 /* Bytes read from stdin per read call */
+#define ARENA_BLOCK_SIZE 65536 /* Bytes per string arena block */
+#define INTERN_BUCKETS 256 /* Initial number of interned string hash buckets */
+
+#define PERSIST_MAGIC "#CMDLINE" /* First bytes of a checksummed history/occurrence file */
+#define PERSIST_VERSION 2 /* Version written into the persisted file header */
+#define PERSIST_HEADER_MAX 64 /* The maximum length of the persisted file header line */
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024 /* Buffers per writev call if the system does not say */
+#endif
+
+#define METRICS_ENV "CMDLINE_METRICS_SOCKET" /* Opt-in metrics socket path, %p is the pid */
+#define METRICS_BUFFER 8192 /* The maximum size of a metrics request or response */
+#define METRICS_TIMEOUT_MS 1000 /* How long a scrape may take to send its request */
+#define SPAWN_BUCKETS 11 /* Finite buckets in the spawn latency histogram */
+
+#define METRIC_HISTORY 0 /* Index of history.txt in metrics.persistNs */
+#define METRIC_OCCURRENCE 1 /* Index of occurrence.txt in metrics.persistNs */
+#define METRIC_LOAD 0 /* Time to read a file on startup */
+#define METRIC_SAVE 1 /* Time to write a file on exit */
+
+#define STALE_TEMP_AGE 60 /* Seconds before a leftover save temp file is removed */
+
+#define PERSIST_OK 0 /* File read and verified */
+#define PERSIST_MISSING 1 /* File does not exist */
+#define PERSIST_CORRUPT 2 /* File is truncated or fails its checksum */
+
+
+// INTERNED STRINGS
+
+struct interned_str {
+    struct interned_str *next;  // next string in the same hash bucket
+    size_t len;                 // length of text, which may contain NULs
+    uint32_t hash;
+    char text[];                // len bytes followed by a '\0'
+};
+
+struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+struct string_arena {
+    struct arena_block *blocks;     // newest block first
+    struct interned_str **buckets;  // every interned string, by hash
+    size_t numBuckets;
+    size_t numStrings;
+    size_t bytesUsed;
+} strArena;
+
+// ENVIRONMENT
+
+struct shell_env {
+    char **entries;         // "NAME=VALUE" strings, owned
+    size_t count;
+    size_t cap;
+    unsigned long version;  // bumped on every change
+} shellEnv;
+
+// envp for children, built from one shellEnv version
+// and never modified once built
+struct env_snapshot {
+    unsigned long version;
+    char **envp;            // NULL terminated, shares shellEnv's strings
+    char **retired;         // strings dropped from shellEnv that envp may
+    size_t retiredCount;    // still point at, freed with this snapshot
+    size_t retiredCap;
+} envSnapshot;
+
+extern char **environ;
+
+// ARGUMENT LIST
+
+struct arg_list {
+    char **argv;        // the arguments, NULL terminated
+    size_t argvCap;
+    char *text;         // copy of the command split into words
+    size_t textCap;
+};
 
 // function prototypes
-void readCommand(char **_cmdPtr);
+ssize_t readCommand(char **_cmdPtr, size_t *_cmdCap);
+
+int parseCommand(struct arg_list *_args, const char *_cmdPtr, size_t _cmdLen);
+
+int isArgSeparator(char _c);
 
-void parseCommand(char **_argsPtr, char *_cmdPtr);
+int isCommand(const char *_cmdPtr, size_t _cmdLen, const char *_name);
 
-void insertHistory(char **_cmdHistory, char *_cmdPtr);
+void insertHistory(const struct interned_str **_cmdHistory, const struct interned_str *_cmd);
 
-void readHistory(char **_cmdHistory);
+void readHistory(const struct interned_str **_cmdHistory);
 
-void writeHistToFile(const char *_fileName, char **_cmdHistory);
+void printCommand(const struct interned_str *_cmd);
 
-void readHistoryFile(const char *filename, char **_cmdHistory);
+void writeHistToFile(const char *_fileName, const struct interned_str **_cmdHistory);
+
+void readHistoryFile(const char *filename, const struct interned_str **_cmdHistory);
 
 void resizeCmdRecord(void);
 
+void *growBuffer(void *_buf, size_t *_cap, size_t _need, size_t _elemSize);
+
+void *arenaAlloc(size_t _size);
+
+const struct interned_str *internString(const char *_text, size_t _len);
+
+void freeStringArena(void);
+
+uint32_t crc32Update(uint32_t _crc, const void *_buf, size_t _len);
+
+int writeAllV(int _fd, struct iovec *_iov, int _iovcnt);
+
+int writeFileAtomic(const char *_fileName, const char *_tag, struct iovec *_iov, int _iovcnt);
+
 
 // global vars
 
-const char CMD_EXIT[] = "exit\n";
-const char CMD_RECENT[] = "recent\n";
+const char CMD_EXIT[] = "exit";
+const char CMD_RECENT[] = "recent";
 const char OCCUR_FILEPATH[] = "occurence.txt";
 const char HIST_FILEPATH[] = "history.txt";
-const char CMD_MFU[] = "mfu\n";
+const char CMD_MFU[] = "mfu";
+const char CMD_EXPORT[] = "export";
+const char CMD_UNSET[] = "unset";
 
 int cmd_record_index = 0;
 int numCmds = MAX_HISTORY;
 int session_started = 0;
 
+// stdin read-ahead shared by calls to readCommand
+char stdin_buffer[READ_CHUNK];
+size_t stdin_start = 0, stdin_end = 0;
+
+// upper bounds, in seconds, of the spawn latency buckets
+const double SPAWN_BUCKET_BOUNDS[SPAWN_BUCKETS] = {0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+                                                   0.05, 0.1, 0.25, 0.5, 1.0};
+
+// METRICS
+// Written by the shell, read by the metrics thread.
+
+struct shell_metrics {
+    atomic_ulong commandsExecuted;      // children that exec'd
+    atomic_ulong commandsFailed;        // ... and exited non zero
+    atomic_ulong forkFailures;
+    atomic_ulong execFailures;          // "Unknown Command."
+    atomic_ulong spawnBuckets[SPAWN_BUCKETS + 1];  // fork to exec, last is +Inf
+    atomic_ulong spawnSumNs;
+    atomic_ulong historyEntries;
+    atomic_ulong occurrenceRecords;
+    atomic_ulong internedStrings;
+    atomic_ulong internedBytes;
+    atomic_ulong persistNs[2][2];       // [METRIC_HISTORY..][METRIC_LOAD..]
+    atomic_int persistSeen[2][2];       // set once persistNs holds a real timing
+    atomic_ulong envReuses;             // launches that reused the envp snapshot
+    atomic_ulong envRebuilds;
+    atomic_ulong envRebuildNs;          // total time spent rebuilding
+    atomic_ulong envVersion;
+    atomic_ulong envVariables;
+} metrics;
+
+struct metrics_server {
+    pthread_t thread;
+    int listenFd;
+    int wakePipe[2];    // written to stop the thread
+    int running;
+    struct sockaddr_un addr;
+} metricsServer = {.listenFd = -1};
+
+uint64_t monotonicNs(void);
+
+pid_t spawnCommand(char **_argv, char **_envp, int *_execFailed);
+
+void importEnvironment(void);
+
+int findVariable(const char *_name, size_t _nameLen);
+
+int setVariable(const char *_name, size_t _nameLen, const char *_value);
+
+int unsetVariable(const char *_name, size_t _nameLen);
+
+void retireVariable(char *_entry);
+
+int isVariableName(const char *_name, size_t _nameLen);
+
+void runExport(char **_argv);
+
+void runUnset(char **_argv);
+
+char **currentEnvironment(void);
+
+void freeEnvironment(void);
+
+void metricsObserveSpawn(uint64_t _ns);
+
+void metricsUpdateTables(const struct interned_str **_cmdHistory);
+
+void metricsRecordPersist(int _file, int _op, uint64_t _ns);
+
+void startMetricsServer(void);
+
+int removeStaleSocket(const char *_path);
+
+void stopMetricsServer(void);
+
+void *metricsThread(void *_arg);
+
+void serveMetricsClient(int _fd);
+
+size_t formatMetrics(char *_buf, size_t _size);
+
+void appendf(char *_buf, size_t _size, size_t *_used, const char *_fmt, ...);
+
+// PERSISTED FILE CONTENTS
+
+struct persist_data {
+    char *buffer;           // the whole file, free() when done
+    const char *payload;    // start of the records within buffer
+    size_t length;          // number of payload bytes
+    unsigned version;       // header version, 0 for a file without header
+};
+
+int readFileVerified(const char *_fileName, const char *_tag, struct persist_data *_data, int _allowLegacy);
+
+int hasCheckedBackup(const char *_bakPath, const char *_tag);
+
+int loadPersisted(const char *_fileName, const char *_tag, struct persist_data *_data);
+
+void splitPath(const char *_fileName, char *_dirPath, size_t _size, const char **_baseName);
+
+void removeStaleTempFiles(const char *_fileName);
+
 // OCCURENCE STRUCTURE
 
 struct cmd_record {
-    char the_command[MAX_LINE];
+    const struct interned_str *the_command;
     int count;
 } **pCmd_record;
 
+// occurrence record layout of files before version 2
+struct cmd_record_v1 {
+    char the_command[MAX_LINE];
+    int count;
+};
+
+// occurrence record header from version 2,
+// followed by length bytes of command text
+struct occurrence_entry {
+    uint32_t count;
+    uint32_t length;
+};
+
 // FUNCTION PROTOTYPES RELYING ON STRUCT
 
 void readOccurrenceFile(const char *filename);
@@ -77,7 +332,7 @@ void allocStruct(struct cmd_record ***_pCmd_record, int _numCmds);
 
 void deallocStruct(struct cmd_record ***_pCmd_record, int _numCmds);
 
-void updateOccurrence(char *_theCommand);
+void updateOccurrence(const struct interned_str *_theCommand);
 
 void printOccurrences(void);
 
@@ -88,65 +343,83 @@ void sortOccurrence(void);
  * @return
  */
 int main(void) {
-    char *args[MAX_ARGS] = {(char *) malloc(sizeof(char) * MAX_LINE), (char *) malloc(sizeof(char) * MAX_LINE),
-                            (char *) malloc(sizeof(char) * MAX_LINE), (char *) malloc(sizeof(char) * MAX_LINE),
-                            (char *) malloc(sizeof(char) * MAX_LINE), (char *) malloc(sizeof(char) * MAX_LINE),
-                            (char *) malloc(sizeof(char) * MAX_LINE), (char *) malloc(sizeof(char) * MAX_LINE),
-                            (char *) malloc(sizeof(char) * MAX_LINE), (char *) malloc(sizeof(char) * MAX_LINE)};
+    struct arg_list args = {NULL, 0, NULL, 0};
 
     int should_run = 1; /* flag to determine if the program should exit */
+    int interactive = isatty(STDIN_FILENO); /* only prompt when a user is typing */
     int child_status = -1;
+    int exec_failed = 0;
     pid_t child_pid = -1, wait_pid = -2;
+    uint64_t started;
+
+    // The input holder grows to fit
+    // the longest line read so far
+    char *commandInput = NULL;
+    size_t commandCap = 0;
+    ssize_t commandLen;
 
-    // Initialize the input holder to
-    // an area of heap memory the size of
-    // MAX_LINE characters
-    char *commandInput = (char *) malloc(MAX_LINE * sizeof(char));
+    // unused slots are NULL
+    const struct interned_str *cmdHistory[MAX_HISTORY] = {NULL};
+    const struct interned_str *theCommand;
 
-    char *cmdHistory[MAX_HISTORY] = {(char *) malloc(sizeof(char) * MAX_LINE), (char *) malloc(sizeof(char) * MAX_LINE),
-                                     (char *) malloc(sizeof(char) * MAX_LINE), (char *) malloc(sizeof(char) * MAX_LINE),
-                                     (char *) malloc(sizeof(char) * MAX_LINE), (char *) malloc(sizeof(char) * MAX_LINE),
-                                     (char *) malloc(sizeof(char) * MAX_LINE), (char *) malloc(sizeof(char) * MAX_LINE),
-                                     (char *) malloc(sizeof(char) * MAX_LINE),
-                                     (char *) malloc(sizeof(char) * MAX_LINE)};
+    // make room for the first few arguments
+    args.argv = growBuffer(args.argv, &args.argvCap, MAX_ARGS + 1, sizeof(char *));
 
     // Initialize the history buffer from
     // the file history.txt
+    started = monotonicNs();
     readHistoryFile(HIST_FILEPATH, cmdHistory);
+    metricsRecordPersist(METRIC_HISTORY, METRIC_LOAD, monotonicNs() - started);
     // initialize the occurrence struct
     allocStruct(&pCmd_record, numCmds);
     // read history for mfu into the struct
+    started = monotonicNs();
     readOccurrenceFile(OCCUR_FILEPATH);
+    metricsRecordPersist(METRIC_OCCURRENCE, METRIC_LOAD, monotonicNs() - started);
+    metricsUpdateTables(cmdHistory);
+
+    // children start with the environment
+    // this shell was given
+    importEnvironment();
+
+    // serve metrics if the user asked for them
+    startMetricsServer();
 
     while (should_run) {
-        printf("COMMAND-> ");
-        fflush(stdout);
+        if (interactive) {
+            printf("COMMAND-> ");
+            fflush(stdout);
+        }
 
-        // Reads input using fgets() and stores
+        // Reads a line of any length and stores
         // the input into the character pointer
         // commandInput
 
-        readCommand(&commandInput);
+        commandLen = readCommand(&commandInput, &commandCap);
 
         // check if the command entered was
-        // exit, if so set flag to 0, and
-        // free memory from allocated pointers
+        // exit, or input has ended. If so set
+        // flag to 0, and save history
 
-        if (strcasecmp(CMD_EXIT, commandInput) == 0) {
+        if (commandLen < 0 || isCommand(commandInput, commandLen, CMD_EXIT)) {
             should_run = 0;
+            started = monotonicNs();
             writeHistToFile(HIST_FILEPATH, cmdHistory);
+            metricsRecordPersist(METRIC_HISTORY, METRIC_SAVE, monotonicNs() - started);
+            started = monotonicNs();
             writeOccurrenceToFile(OCCUR_FILEPATH);
+            metricsRecordPersist(METRIC_OCCURRENCE, METRIC_SAVE, monotonicNs() - started);
             continue;
         }
 
             // Check if command was recent, then
             // we should print the history of cmds
 
-        else if (strcasecmp(CMD_RECENT, commandInput) == 0) {
+        else if (isCommand(commandInput, commandLen, CMD_RECENT)) {
             readHistory(cmdHistory);
             continue;
 
-        } else if (strcasecmp(CMD_MFU, commandInput) == 0) {
+        } else if (isCommand(commandInput, commandLen, CMD_MFU)) {
             printOccurrences();
             continue;
         } else {
@@ -189,7 +462,7 @@ int main(void) {
 
                 }
 
-                if (**(cmdHistory + cmdIndex) == '\0') {
+                if (cmdIndex < 0 || *(cmdHistory + cmdIndex) == NULL) {
                     printf("There is no recent command number %i\n", cmdIndex + 1);
                     continue;
                 }
@@ -198,211 +471,220 @@ int main(void) {
                 // and parse the command input
                 // back into the args array.
 
-                memcpy(commandInput, *(cmdHistory + cmdIndex), sizeof(char) * MAX_LINE);
-                printf("COMMAND-> %s", commandInput);
+                commandLen = (*(cmdHistory + cmdIndex))->len;
+                commandInput = growBuffer(commandInput, &commandCap, commandLen + 1, sizeof(char));
+                memcpy(commandInput, (*(cmdHistory + cmdIndex))->text, commandLen + 1);
+                if (interactive) {
+                    printf("COMMAND-> ");
+                }
+                printCommand(*(cmdHistory + cmdIndex));
+                printf("\n");
 
             }
 
-            parseCommand(args, commandInput);
+            // blank lines run nothing
+            if (parseCommand(&args, commandInput, commandLen) == 0) {
+                continue;
+            }
 
-            child_pid = fork();
-            fflush(stdout);
+            // variables are set in the shell itself
+            if (strcasecmp(*args.argv, CMD_EXPORT) == 0) {
+                runExport(args.argv);
+                continue;
+            } else if (strcasecmp(*args.argv, CMD_UNSET) == 0) {
+                runUnset(args.argv);
+                continue;
+            }
 
-            if (child_pid == 0) {
-                fflush(stdout);
-                execvp(*args, args);
-                printf("Unknown Command.\n");
-                exit(2);
-            } else if (child_pid < 0) {
-                printf("\nFork Failed");
-                exit(1);
-            } else {
-                while (wait_pid != child_pid)
-                    wait_pid = wait(&child_status);
+            child_pid = spawnCommand(args.argv, currentEnvironment(), &exec_failed);
+
+            // a failed fork leaves the shell running
+            if (child_pid < 0) {
+                continue;
             }
 
+            while (wait_pid != child_pid)
+                wait_pid = wait(&child_status);
+
             if (child_status == 0) {
                 session_started = 1;
-                insertHistory(cmdHistory, commandInput);
-                updateOccurrence(commandInput);
+                theCommand = internString(commandInput, commandLen);
+                insertHistory(cmdHistory, theCommand);
+                updateOccurrence(theCommand);
+                metricsUpdateTables(cmdHistory);
+            } else if (!exec_failed) {
+                atomic_fetch_add(&metrics.commandsFailed, 1);
             }
         }
 
 
     }
 
+    stopMetricsServer();
+
     free(commandInput);
+    free(args.argv);
+    free(args.text);
     deallocStruct(&pCmd_record, numCmds);
-
-    int i;
-
-    for (i = 0; i < MAX_ARGS; i++) {
-        free(*(args + i));
-    }
-
-    for (i = 0; i < MAX_HISTORY; i++) {
-        free(*(cmdHistory + i));
-    }
+    freeStringArena();
+    freeEnvironment();
 
     return 0;
 }
 
 /**
-	Reads and returns up to 81 characters entered
-	by the user as the command.
-	
-	Requires a pointer to a pointer.  Then references
-	the value of the pointer, which is the address of
-	the pointer contained in main.  This can then be
-	passed to the next function, parse command.
-	
-*/
-
-void readCommand(char **_cmdPtr) {
+	Reads one line of any length from stdin into
+	*_cmdPtr, growing it as needed.  The newline is
+	dropped and the line is '\0' terminated, but it
+	may itself contain NUL bytes, so callers use the
+	returned length.
 
-    fgets(*_cmdPtr, MAX_LINE, stdin);
-    fflush(stdin);
+	Input is read in READ_CHUNK blocks and split on
+	'\n' with memchr, so a file of commands streams
+	through without a system call per line.
 
-    return;
-}
-
-/**
-	Parses the text in _cmdPtr into a maximum
-	of ten different command line arguments.
-	
-	The command line arguments will be updated 
-	in main, so they may be passed back to the
-	the original function and used for to fork
-	new processes.
-	
+	Returns the length of the line, or -1 at end of input.
 */
 
-void parseCommand(char **_argsPtr, char *_cmdPtr) {
+ssize_t readCommand(char **_cmdPtr, size_t *_cmdCap) {
 
-    int i = 0, argIndex = 0, wordPosition = 0, count = 0;
+    size_t length = 0, chunk;
+    const char *eol;
+    ssize_t got;
 
-    // loop through the array
+    for (;;) {
+        // refill the read-ahead buffer
+        if (stdin_start == stdin_end) {
+            got = read(STDIN_FILENO, stdin_buffer, READ_CHUNK);
 
-    for (i = 0; i < MAX_LINE; i++) {
+            if (got < 0 && errno == EINTR)
+                continue;
 
+            if (got <= 0) {
+                // a last line without a newline
+                // is still a command
+                if (length == 0)
+                    return -1;
+                break;
+            }
 
+            stdin_start = 0;
+            stdin_end = (size_t) got;
+        }
 
+        eol = memchr(stdin_buffer + stdin_start, '\n', stdin_end - stdin_start);
+        chunk = (eol == NULL) ? stdin_end - stdin_start : (size_t) (eol - (stdin_buffer + stdin_start));
 
-        // if the current char in array is
-        // a space or null 0, then it is ready
-        // to add to the args array.  We start
-        // by allocating memory in the args array
-        // equal to the total count of chars we need, increment argsPtr to
-        // next argument, and continue loop
-        // reset our arg char index, j, to 0
-
-        if (_cmdPtr[i] == ' ' || _cmdPtr[i] == '\0' || _cmdPtr[i] == '\n') {
-
-
-            // CHECK TO SEE IF ARGS IS NULL (MEANING NO MEMORY ALLOCATED)
-            // IF SO WE MUST REALLOCATE MEMORY
+        *_cmdPtr = growBuffer(*_cmdPtr, _cmdCap, length + chunk + 1, sizeof(char));
+        memcpy(*_cmdPtr + length, stdin_buffer + stdin_start, chunk);
+        length += chunk;
+        stdin_start += chunk;
 
-            if (*_argsPtr == (char *) NULL) {
-                *_argsPtr = (char *) malloc(sizeof(char) * MAX_LINE);
-            }
+        if (eol != NULL) {
+            stdin_start++; // skip the newline
+            break;
+        }
+    }
 
-            // first check to see if the current char is '\0'
-            // if it is, then we must set the current char[]
-            // to null.  NULL is required as the last argument
-            // to commands such as LS to work properly.
-            // Allocating memory results in char[]='\0', which
-            // will cause LS to fail.
+    (*_cmdPtr)[length] = '\0';
 
-            if (_cmdPtr[i] == '\0') {
-                *_argsPtr = (char *) NULL;
-                break;
-            }
+    return (ssize_t) length;
+}
 
-            // Initialize the current array of chars in memory
-            // for the args pointer to match the size of the current
-            // word plus one
+/**
+	Splits the _cmdLen bytes at _cmdPtr into words
+	separated by spaces, tabs or NUL bytes.
 
-            //*(_argsPtr) = (char*)malloc(count+1*sizeof(char));
+	The words are copied into _args->text and
+	_args->argv points at each of them, followed
+	by NULL, ready to be passed to execvp.  Both
+	grow to fit any number of arguments.
 
-            // set the wordPosition relative to the full
-            // command string.  This is the position we
-            // we want to start extracting from the full
-            // command string.
-            wordPosition = i - count;
+	Returns the number of arguments found.
+*/
 
-            // counting variable to iterate onto the new string
-            int j = 0;
-            while (j < count) {
+int parseCommand(struct arg_list *_args, const char *_cmdPtr, size_t _cmdLen) {
 
-                // if character is '\n' we need to break
-                // the loop.
+    size_t i = 0;
+    int argc = 0;
 
-                if (*(_cmdPtr + wordPosition) == '\n') {
-                    *(*(_argsPtr) + j) = *(char *) NULL;
-                    break;
-                }
+    _args->text = growBuffer(_args->text, &_args->textCap, _cmdLen + 1, sizeof(char));
+    memcpy(_args->text, _cmdPtr, _cmdLen);
+    _args->text[_cmdLen] = '\0';
 
-                // set the new string (char array) equal to the
-                // value stored
-                // in the sentence at the current word position
-                // and increment both forward.
+    while (i < _cmdLen) {
 
-                // j = char position in array
-                // wordPosition = char position in full command
+        // terminate the previous word and
+        // skip any run of separators
+        while (i < _cmdLen && isArgSeparator(_args->text[i])) {
+            _args->text[i] = '\0';
+            i++;
+        }
 
-                *(*(_argsPtr) + j) = *(_cmdPtr + wordPosition);
+        if (i == _cmdLen) {
+            break;
+        }
 
-                j++;
-                wordPosition++;
-            }
+        // leave room for the NULL terminator
+        _args->argv = growBuffer(_args->argv, &_args->argvCap, argc + 2, sizeof(char *));
+        _args->argv[argc++] = _args->text + i;
 
-            // place a null character at the end of the
-            // current char array to mark string end.
-            if (count > 0)
-                *(*(_argsPtr) + count) = '\0';
-
-            // Increment the _argsPtr to the next array
-            // element
-            // e.g. equivalent to myArray[index++]
-            // reset counting and position variables.
-            _argsPtr++;
-            count = 0;
-            wordPosition = 0;
-            continue;
+        while (i < _cmdLen && !isArgSeparator(_args->text[i])) {
+            i++;
         }
+    }
 
-        // keep count of the number of letters
-        // in the current arg, so we can initialize
-        // that arg.
+    // NULL is required as the last argument
+    // to commands such as LS to work properly.
+    _args->argv = growBuffer(_args->argv, &_args->argvCap, argc + 1, sizeof(char *));
+    _args->argv[argc] = (char *) NULL;
 
-        count++;
+    return argc;
 
-    }
+}
 
-    return;
+/**
+ * True if _c ends a command line argument.
+ */
+int isArgSeparator(char _c) {
+    return _c == ' ' || _c == '\t' || _c == '\0';
+}
 
+/**
+ * Compares the line read to a builtin
+ * command name, ignoring case.
+ *
+ * @param _cmdPtr   The line read.
+ * @param _cmdLen   Length of the line read.
+ * @param _name     The builtin, e.g. CMD_EXIT.
+ * @return non zero if they match.
+ */
+int isCommand(const char *_cmdPtr, size_t _cmdLen, const char *_name) {
+    return _cmdLen == strlen(_name) && strncasecmp(_cmdPtr, _name, _cmdLen) == 0;
 }
 
 /**
- * Inserst the current _cmdPtr into
+ * Inserst the current _cmd into
  * the running _cmdHistory
  *
  * @param _cmdHistory  This is the 'buffer'
  *                      of commands stored.
- * @param _cmdPtr       This it the command
+ * @param _cmd          This it the command
  *                      to be stored in the
  *                      buffer.
  */
 
-void insertHistory(char **_cmdHistory, char *_cmdPtr) {
+void insertHistory(const struct interned_str **_cmdHistory, const struct interned_str *_cmd) {
 
     int i;
 
+    // the strings are interned, so only
+    // the pointers need to move
     for (i = MAX_HISTORY - 1; i > 0; i--) {
-        memcpy(*(_cmdHistory + i), *(_cmdHistory + (i - 1)), sizeof(char) * MAX_LINE);
+        *(_cmdHistory + i) = *(_cmdHistory + (i - 1));
     }
 
-    memcpy(*(_cmdHistory), _cmdPtr, sizeof(char) * MAX_LINE);
+    *(_cmdHistory) = _cmd;
 
     return;
 }
@@ -416,274 +698,839 @@ void insertHistory(char **_cmdHistory, char *_cmdPtr) {
  *
  */
 
-void readHistory(char **_cmdHistory) {
+void readHistory(const struct interned_str **_cmdHistory) {
     int i = 0;
 
     for (i = 0; i < MAX_HISTORY; i++) {
         if (i == 0 && (*(_cmdHistory) == NULL)) {
             printf("No recent commands\n");
             break;
-        } else if (*(_cmdHistory + i) == NULL || *(*(_cmdHistory + i)) == '\0') {
+        } else if (*(_cmdHistory + i) == NULL) {
             break;
         } else {
-            printf("%i %s", i + 1, *(_cmdHistory + i));
+            printf("%i ", i + 1);
+            printCommand(*(_cmdHistory + i));
+            printf("\n");
         }
     }
 }
 
 /**
- * Writes an occurrence of a
+ * Prints a stored command, including
+ * any NUL bytes it contains.
+ */
+void printCommand(const struct interned_str *_cmd) {
+    fwrite(_cmd->text, sizeof(char), _cmd->len, stdout);
+}
+
+/**
+ * Writes the occurrence records to filename.
+ * All records go out in one batched writev
+ * through writeFileAtomic, so a failed save
+ * leaves the previous file untouched.
+ *
  * @param filename
  */
 void writeOccurrenceToFile(const char *filename) {
 
-    FILE *fptr;  // pointer to the file
+    // slot 0 is reserved for the file header, then
+    // each record is an entry header and its text
+    struct iovec *iov = malloc(sizeof(struct iovec) * (2 * cmd_record_index + 1));
+    struct occurrence_entry *entries = malloc(sizeof(struct occurrence_entry) * (cmd_record_index + 1));
     int i;
 
-    if ((fptr = fopen(filename, "wb")) == NULL) {  // open a binary file for writing (overwrite contents)
-        printf("fopen [wb] error!\n");  // file open failed
-        //exit(1);
+    if (iov == NULL || entries == NULL) {
+        printf("Unable to save %s: out of memory\n", filename);
+        free(iov);
+        free(entries);
+        return;
     }
 
-    for (i = 0; i < cmd_record_index; i++) {  // write 5 samples
-        fwrite(pCmd_record[i], sizeof(struct cmd_record), 1, fptr); // write one structure into the file
+    for (i = 0; i < cmd_record_index; i++) {
+        entries[i].count = (uint32_t) pCmd_record[i]->count;
+        entries[i].length = (uint32_t) pCmd_record[i]->the_command->len;
+
+        iov[2 * i + 1].iov_base = &entries[i];
+        iov[2 * i + 1].iov_len = sizeof(struct occurrence_entry);
+        iov[2 * i + 2].iov_base = (void *) pCmd_record[i]->the_command->text;
+        iov[2 * i + 2].iov_len = pCmd_record[i]->the_command->len;
     }
 
-    fclose(fptr); // close the file
+    writeFileAtomic(filename, "occurrence", iov, 2 * cmd_record_index + 1);
+    free(iov);
+    free(entries);
 }
 
-// a sample function to write structure data into a file
-void writeHistToFile(const char *filename, char **_cmdHistory) {
-    FILE *fptr;  // pointer to the file
+/**
+ * Writes the history buffer to filename, one
+ * command per line, through writeFileAtomic.
+ *
+ * @param filename
+ * @param _cmdHistory The array of history
+ * commands the user has entered.
+ */
+void writeHistToFile(const char *filename, const struct interned_str **_cmdHistory) {
+    static char newline[] = "\n";
+    struct iovec iov[2 * MAX_HISTORY + 1];  // slot 0 is reserved for the file header
     int i;
 
-    if ((fptr = fopen(filename, "wb")) == NULL) {  // open a binary file for writing (overwrite contents)
-        printf("fopen [wb] error!\n");  // file open failed
-        exit(1);
-    }
-
-    // writes the history buffer to the
-    // history.txt file.
-
     for (i = 0; i < MAX_HISTORY; i++) {
         // if the command is null, then
         // we are at the end of the buffer
         // break the loop
-        if (*(_cmdHistory + i) == (char *) NULL) {
+        if (*(_cmdHistory + i) == NULL) {
             break;
         }
-        // else we write this command
-        fwrite(*(_cmdHistory + i), sizeof(char) * strlen(*(_cmdHistory + i)), 1,
-               fptr); // write one structure into the file
+        iov[2 * i + 1].iov_base = (void *) (*(_cmdHistory + i))->text;
+        iov[2 * i + 1].iov_len = (*(_cmdHistory + i))->len;
+        iov[2 * i + 2].iov_base = newline;
+        iov[2 * i + 2].iov_len = 1;
     }
-    fclose(fptr); // close the file
-}
-
-// a sample function to read structure data from a file
-void readOccurrenceFile(const char *filename) {
 
-    FILE *fptr;  // pointer to the file
+    writeFileAtomic(filename, "history", iov, 2 * i + 1);
+}
 
-    if ((fptr = fopen(filename, "rb")) == NULL) {  // open a binary file for reading
-        if (session_started) {
-            printf("fopen [rb] error!\n");  // file open failed
-            return;
-        } else {
-            printf("Occurrence File not found.  File will be created on exit.\n");
-            return;
+/**
+ * Standard CRC-32 (IEEE 802.3) of _buf, continuing
+ * from a previous _crc.  Pass 0 to start a new sum.
+ */
+uint32_t crc32Update(uint32_t _crc, const void *_buf, size_t _len) {
+    static uint32_t table[256];
+    static int tableReady = 0;
+    const unsigned char *p = _buf;
+    size_t i;
+
+    if (!tableReady) {
+        uint32_t c;
+        int n, k;
+
+        for (n = 0; n < 256; n++) {
+            c = (uint32_t) n;
+            for (k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            table[n] = c;
         }
+        tableReady = 1;
     }
 
-    // read the file in fptr, reading a single struct
-    // into the pCmd_record.
-    // If no more structs in file, the loop will break;
+    _crc = ~_crc;
+    for (i = 0; i < _len; i++) {
+        _crc = table[(_crc ^ p[i]) & 0xFF] ^ (_crc >> 8);
+    }
 
-    // temp struct to store read data into.
-    struct cmd_record *p = malloc(sizeof(struct cmd_record));
+    return ~_crc;
+}
 
-    while (fread(p, sizeof(struct cmd_record), 1, fptr) ==
-           1) {
+/**
+ * Writes every buffer in _iov to _fd, retrying
+ * short writes and splitting the batch into
+ * IOV_MAX sized writev calls.  _iov is consumed.
+ *
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int writeAllV(int _fd, struct iovec *_iov, int _iovcnt) {
+    ssize_t written;
 
-        // perform a deep copy of the temp
-        // to our global var.
-        pCmd_record[cmd_record_index]->count = p->count;
-        strcpy(pCmd_record[cmd_record_index]->the_command, p->the_command);
+    while (_iovcnt > 0) {
+        written = writev(_fd, _iov, _iovcnt < IOV_MAX ? _iovcnt : IOV_MAX);
 
-        cmd_record_index++;
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
 
-        /*
-         * If our index is past our num of commands
-         * we need to update the number of commands
-         * and resize our pointer so we have enough
-         * memory allocated to hold the file contents
-         */
+        // skip the buffers that were written in full,
+        // then advance into the partially written one
+        while (_iovcnt > 0 && (size_t) written >= _iov->iov_len) {
+            written -= _iov->iov_len;
+            _iov++;
+            _iovcnt--;
+        }
 
-        if (cmd_record_index > (numCmds - 1)) {
-            numCmds *= 2;
-            resizeCmdRecord();
+        if (_iovcnt > 0) {
+            _iov->iov_base = (char *) _iov->iov_base + written;
+            _iov->iov_len -= written;
         }
+    }
 
+    return 0;
+}
 
-        //printf("The command [%s] appeared %d times.\n", *pCmd_.cmd, entry.count);
-    }
+/**
+ * Atomically replaces _fileName with the buffers in
+ * _iov[1] .. _iov[_iovcnt - 1].  _iov[0] is filled in
+ * with a header holding _tag, the payload length and
+ * its CRC-32.
+ *
+ * The data goes to a unique <file>.XXXXXX, is fsync'd
+ * and then renamed over <file>, so a crash, a full
+ * disk or another shell saving at the same time
+ * leaves either the old or a new file in place.
+ * The old file is kept as <file>.bak if it is intact.
+ * A crash mid save can leave <file>.XXXXXX or
+ * <file>.bak.<pid> behind; removeStaleTempFiles
+ * clears them on the next load.
+ *
+ * @return 0 on success, -1 if the file was left unchanged.
+ */
+int writeFileAtomic(const char *_fileName, const char *_tag, struct iovec *_iov, int _iovcnt) {
+    char header[PERSIST_HEADER_MAX];
+    char tmpPath[PATH_MAX], bakPath[PATH_MAX], bakTmpPath[PATH_MAX], dirPath[PATH_MAX];
+    const char *baseName;
+    struct persist_data current;
+    size_t length = 0;
+    uint32_t crc = 0;
+    int fd, i, err, allowLegacy;
 
-    if (feof(fptr)) {
-        // TODO
-        // printf("fread read past the end of file!\n");
+    for (i = 1; i < _iovcnt; i++) {
+        crc = crc32Update(crc, _iov[i].iov_base, _iov[i].iov_len);
+        length += _iov[i].iov_len;
     }
 
-    fclose(fptr); // close the file
-    free(p);
+    _iov[0].iov_base = header;
+    _iov[0].iov_len = snprintf(header, sizeof(header), "%s %s v%d %zu %08x\n",
+                               PERSIST_MAGIC, _tag, PERSIST_VERSION, length, (unsigned) crc);
 
-}
-
-void readHistoryFile(const char *filename, char **_cmdHistory) {
+    snprintf(tmpPath, sizeof(tmpPath), "%s.XXXXXX", _fileName);
+    snprintf(bakPath, sizeof(bakPath), "%s.bak", _fileName);
+    snprintf(bakTmpPath, sizeof(bakTmpPath), "%s.bak.%ld", _fileName, (long) getpid());
 
-    FILE *fptr;  // pointer to the file
+    // a temp file of our own, so shells exiting
+    // together never write into each other's
+    if ((fd = mkstemp(tmpPath)) < 0) {
+        printf("Unable to save %s: %s\n", _fileName, strerror(errno));
+        return -1;
+    }
 
-    if ((fptr = fopen(filename, "rb")) == NULL) {  // open a binary file for reading
-        if (session_started) {
-            printf("fopen %s [rb] error!\n", filename);  // file open failed
-            return;
-        } else {
-            printf("History File not found.  File will be created on exit.\n");
-            return;
-        }
+    if (fchmod(fd, 0644) != 0 || writeAllV(fd, _iov, _iovcnt) != 0 || fsync(fd) != 0) {
+        err = errno;
+        close(fd);
+        unlink(tmpPath);
+        printf("Unable to save %s: %s\n", _fileName, strerror(err));
+        return -1;
     }
 
-    // read the file in fptr, reading a single struct
-    // into the pCmd_record.
-    // If no more structs in file, the loop will break;
-    int cmdIndex = 0;
-    int brkLoop = 0;
-    size_t length = 0;
-    ssize_t reader = 0;
+    if (close(fd) != 0) {
+        err = errno;
+        unlink(tmpPath);
+        printf("Unable to save %s: %s\n", _fileName, strerror(err));
+        return -1;
+    }
 
-    while ((reader != -1) & (brkLoop == 0)) {
+    // keep the current file as the rolling backup,
+    // but never replace a good backup with a bad file.
+    // The link goes to a temporary name first so the
+    // old backup is only replaced once it succeeds.
+    allowLegacy = !hasCheckedBackup(bakPath, _tag);
+    if (readFileVerified(_fileName, _tag, &current, allowLegacy) == PERSIST_OK) {
+        free(current.buffer);
+        unlink(bakTmpPath);
+
+        if (link(_fileName, bakTmpPath) != 0) {
+            printf("Unable to update %s: %s\n", bakPath, strerror(errno));
+        } else if (rename(bakTmpPath, bakPath) != 0) {
+            printf("Unable to update %s: %s\n", bakPath, strerror(errno));
+            unlink(bakTmpPath);
+        }
+    }
 
-        reader = getline(&_cmdHistory[cmdIndex], &length, fptr);
+    if (rename(tmpPath, _fileName) != 0) {
+        err = errno;
+        unlink(tmpPath);
+        printf("Unable to save %s: %s\n", _fileName, strerror(err));
+        return -1;
+    }
 
-        // DEBUG CODE
-        //printf("Read the command: %s", (_cmdHistory[cmdIndex]));
+    // fsync the directory so the rename itself
+    // survives a crash
+    splitPath(_fileName, dirPath, sizeof(dirPath), &baseName);
 
-        cmdIndex++;
-        /*
-         * Check to see if the index has passed
-         * the MAX history line.  If so, we need
-         * to break the loop, as there should be
-         * no more history.
-         */
-        if (cmdIndex > (MAX_HISTORY - 1)) {
-            brkLoop = 1;
-        }
+    if ((fd = open(dirPath, O_RDONLY)) >= 0) {
+        fsync(fd);
+        close(fd);
     }
 
-    fclose(fptr); // close the file
-
+    return 0;
 }
 
 /**
- * Resizes the cmd_record ptr to
- * the updated number of cmd_records
- * (numCmds).  Does a deep copy,
- * deletes, and then reinitializes the
- * struct.
+ * Reads all of _fileName into _data and checks its
+ * header against _tag, the payload length and the
+ * CRC-32.  If _allowLegacy is set, a file without a
+ * header is accepted as one written by an earlier
+ * version (version 0), including an empty file, which
+ * earlier versions wrote when no command had run.
+ * Without _allowLegacy an empty file is corrupt.
+ *
+ * @return PERSIST_OK, PERSIST_MISSING or PERSIST_CORRUPT.
+ * On PERSIST_OK the caller must free _data->buffer.
  */
+int readFileVerified(const char *_fileName, const char *_tag, struct persist_data *_data, int _allowLegacy) {
+    struct stat st;
+    char tag[16];
+    unsigned version, crc;
+    size_t length, got = 0, magicLen = strlen(PERSIST_MAGIC);
+    ssize_t n;
+    const char *eol;
+    int fd;
+
+    memset(_data, 0, sizeof(*_data));
+
+    if ((fd = open(_fileName, O_RDONLY)) < 0) {
+        return errno == ENOENT ? PERSIST_MISSING : PERSIST_CORRUPT;
+    }
 
-void resizeCmdRecord(void) {
-
-    // temp struct pointer to copy
-    // the original into.
-    struct cmd_record **ptr_record_temp;
-    // allocate memory for temp struct
-    allocStruct(&ptr_record_temp, cmd_record_index);
+    if (fstat(fd, &st) != 0 || (_data->buffer = malloc(st.st_size + 1)) == NULL) {
+        close(fd);
+        return PERSIST_CORRUPT;
+    }
 
-    int index;
-    // copy contents from global struct
-    // into the temp struct
-    for (index = 0; index < cmd_record_index; index++) {
-        ptr_record_temp[index]->count = pCmd_record[index]->count;
-        memcpy(ptr_record_temp[index]->the_command, pCmd_record[index]->the_command, sizeof(char) * MAX_LINE);
+    while (got < (size_t) st.st_size) {
+        n = read(fd, _data->buffer + got, st.st_size - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    close(fd);
+    _data->buffer[got] = '\0';
+
+    if (_allowLegacy && got == (size_t) st.st_size
+        && (got < magicLen || memcmp(_data->buffer, PERSIST_MAGIC, magicLen) != 0)) {
+        // a file cut off inside the magic is
+        // not a file from an earlier version
+        if (got == 0 || memcmp(_data->buffer, PERSIST_MAGIC, got < magicLen ? got : magicLen) != 0) {
+            _data->payload = _data->buffer;
+            _data->length = got;
+            _data->version = 0;
+            return PERSIST_OK;
+        }
     }
-    // free the global, then reallocate
-    // with
-    deallocStruct(&pCmd_record, cmd_record_index);
-    allocStruct(&pCmd_record, numCmds);
 
-    // copy from temp back to global struct
-    for (index = 0; index < cmd_record_index; index++) {
-        pCmd_record[index]->count = ptr_record_temp[index]->count;
-        memcpy(pCmd_record[index]->the_command, ptr_record_temp[index]->the_command, sizeof(char) * MAX_LINE);
+    eol = memchr(_data->buffer, '\n', got < PERSIST_HEADER_MAX ? got : PERSIST_HEADER_MAX);
+
+    if (got != (size_t) st.st_size || got < magicLen || memcmp(_data->buffer, PERSIST_MAGIC, magicLen) != 0
+        || eol == NULL
+        || sscanf(_data->buffer + magicLen, " %15s v%u %zu %x", tag, &version, &length, &crc) != 4
+        || strcmp(tag, _tag) != 0
+        || (size_t) (_data->buffer + got - (eol + 1)) != length
+        || crc32Update(0, eol + 1, length) != crc) {
+        free(_data->buffer);
+        _data->buffer = NULL;
+        return PERSIST_CORRUPT;
     }
 
-    // free the temp struct
-    deallocStruct(&ptr_record_temp, cmd_record_index);
+    _data->payload = eol + 1;
+    _data->length = length;
+    _data->version = version;
 
+    return PERSIST_OK;
 }
 
 /**
- * Allocates the struct into memory
- * using global variables.
- *
+ * True if _bakPath holds a backup written with
+ * a header, which means the main file was too.
  */
-void allocStruct(struct cmd_record ***_pCmd_record, int _numCmds) {
+int hasCheckedBackup(const char *_bakPath, const char *_tag) {
+    struct persist_data backup;
 
-    //_pCmd_record = (struct cmd_record *) malloc(_numCmds * sizeof(struct cmd_record));
-    *_pCmd_record = malloc(_numCmds * sizeof(struct cmd_record));
-
-    int i;
-    for (i = 0; i < _numCmds; i++) {
-        *((*_pCmd_record) + i) = malloc(sizeof(struct cmd_record));
+    if (readFileVerified(_bakPath, _tag, &backup, 0) != PERSIST_OK) {
+        return 0;
     }
+
+    free(backup.buffer);
+    return 1;
 }
 
 /**
- * Reclaims the memory from the
- * pCmd_record ** so it can be
- * reused later in the program.
+ * Loads _fileName into _data, falling back to the
+ * rolling <file>.bak copy if the main file is corrupt.
+ * Once a checksummed backup exists, a main file
+ * without a header is damaged, not from an earlier
+ * version.
+ *
+ * @return PERSIST_OK if either copy could be used.
  */
+int loadPersisted(const char *_fileName, const char *_tag, struct persist_data *_data) {
+    char bakPath[PATH_MAX];
+    int status;
 
-void deallocStruct(struct cmd_record ***_pCmd_record, int _numCmds) {
+    snprintf(bakPath, sizeof(bakPath), "%s.bak", _fileName);
 
-    int i;
-    // free each pointer in the array
-    for (i = 0; i < _numCmds; i++) {
-        free(*(*(_pCmd_record) + i));
+    removeStaleTempFiles(_fileName);
+
+    status = readFileVerified(_fileName, _tag, _data, !hasCheckedBackup(bakPath, _tag));
+
+    if (status != PERSIST_CORRUPT) {
+        return status;
     }
-    // free the pointer to the array
-    free(*_pCmd_record);
 
+    if (readFileVerified(bakPath, _tag, _data, 1) == PERSIST_OK) {
+        printf("%s is corrupt.  Restored from %s.\n", _fileName, bakPath);
+        return PERSIST_OK;
+    }
+
+    printf("%s is corrupt and no backup could be read.  Starting empty.\n", _fileName);
+    return PERSIST_CORRUPT;
 }
 
 /**
- *
- * @param _pCmd_record
- * @param _theCommand
+ * Splits _fileName into the directory holding it,
+ * written to _dirPath, and its last component.
  */
-void updateOccurrence(char *_theCommand) {
-
-    // first we look to see if this command has occurred
-    // so we can update occurrence count and return
-    int i;
-
-    for (i = 0; i < cmd_record_index; i++) {
-        if (strcmp(pCmd_record[i]->the_command, _theCommand) == 0) {
-            pCmd_record[i]->count++;
-            sortOccurrence();
-            return;
-        };
+void splitPath(const char *_fileName, char *_dirPath, size_t _size, const char **_baseName) {
+    const char *slash = strrchr(_fileName, '/');
+
+    if (slash == NULL) {
+        snprintf(_dirPath, _size, ".");
+        *_baseName = _fileName;
+    } else if (slash == _fileName) {
+        snprintf(_dirPath, _size, "/");
+        *_baseName = slash + 1;
+    } else {
+        snprintf(_dirPath, _size, "%.*s", (int) (slash - _fileName), _fileName);
+        *_baseName = slash + 1;
     }
+}
 
-    // if we continue, we need to move our index along
+/**
+ * Removes the <file>.XXXXXX and <file>.bak.<pid>
+ * files left by a shell killed while saving.
+ * Only files older than STALE_TEMP_AGE are
+ * removed, so a save in progress in another
+ * shell is left alone, and only if they are
+ * empty or start with PERSIST_MAGIC, so a
+ * user's own file of a similar name is kept.
+ */
+void removeStaleTempFiles(const char *_fileName) {
+    char dirPath[PATH_MAX], path[PATH_MAX + sizeof(((struct dirent *) 0)->d_name)];
+    char magic[sizeof(PERSIST_MAGIC) - 1];
+    const char *baseName, *suffix;
+    struct dirent *entry;
+    struct stat st;
+    size_t baseLen, i;
+    int isTemp, fd;
+    DIR *dir;
+
+    splitPath(_fileName, dirPath, sizeof(dirPath), &baseName);
+    baseLen = strlen(baseName);
+
+    if ((dir = opendir(dirPath)) == NULL) {
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, baseName, baseLen) != 0 || entry->d_name[baseLen] != '.') {
+            continue;
+        }
+        suffix = entry->d_name + baseLen + 1;
+
+        if (strncmp(suffix, "bak.", 4) == 0 && suffix[4] != '\0') {
+            // <file>.bak.<pid>
+            isTemp = 1;
+            for (i = 4; suffix[i] != '\0'; i++) {
+                isTemp = isTemp && isdigit((unsigned char) suffix[i]);
+            }
+        } else {
+            // <file>.XXXXXX from mkstemp
+            isTemp = strlen(suffix) == 6;
+            for (i = 0; isTemp && i < 6; i++) {
+                isTemp = isalnum((unsigned char) suffix[i]);
+            }
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", dirPath, entry->d_name);
+
+        if (!isTemp || lstat(path, &st) != 0 || !S_ISREG(st.st_mode)
+            || time(NULL) - st.st_mtime <= STALE_TEMP_AGE) {
+            continue;
+        }
+
+        if (st.st_size > 0) {
+            if ((fd = open(path, O_RDONLY)) < 0) {
+                continue;
+            }
+            isTemp = read(fd, magic, sizeof(magic)) == (ssize_t) sizeof(magic)
+                     && memcmp(magic, PERSIST_MAGIC, sizeof(magic)) == 0;
+            close(fd);
+        }
+
+        if (isTemp) {
+            unlink(path);
+        }
+    }
+
+    closedir(dir);
+}
+
+/**
+ * Reads the occurrence records saved by
+ * writeOccurrenceToFile into pCmd_record.
+ * Files written before version 2 hold
+ * fixed size struct cmd_record_v1 records.
+ *
+ * @param filename
+ */
+void readOccurrenceFile(const char *filename) {
+
+    struct persist_data data;
+    struct occurrence_entry entry;
+    struct cmd_record_v1 record;
+    size_t offset = 0, length;
+    int count;
+    int status = loadPersisted(filename, "occurrence", &data);
+
+    if (status == PERSIST_MISSING) {
+        printf("Occurrence File not found.  File will be created on exit.\n");
+        return;
+    } else if (status != PERSIST_OK) {
+        return;
+    }
+
+    // a partial record at the end is ignored.
+    while (offset < data.length) {
+
+        if (data.version >= 2) {
+            if (data.length - offset < sizeof(entry)) {
+                break;
+            }
+            memcpy(&entry, data.payload + offset, sizeof(entry));
+            offset += sizeof(entry);
+
+            if (data.length - offset < entry.length) {
+                break;
+            }
+            pCmd_record[cmd_record_index]->the_command = internString(data.payload + offset, entry.length);
+            pCmd_record[cmd_record_index]->count = (int) entry.count;
+            offset += entry.length;
+        } else {
+            if (data.length - offset < sizeof(record)) {
+                break;
+            }
+            memcpy(&record, data.payload + offset, sizeof(record));
+            offset += sizeof(record);
+
+            // the old records kept the newline
+            length = strnlen(record.the_command, MAX_LINE);
+            if (length > 0 && record.the_command[length - 1] == '\n') {
+                length--;
+            }
+            count = record.count;
+            pCmd_record[cmd_record_index]->the_command = internString(record.the_command, length);
+            pCmd_record[cmd_record_index]->count = count;
+        }
+
+        cmd_record_index++;
+
+        /*
+         * If our index is past our num of commands
+         * we need to update the number of commands
+         * and resize our pointer so we have enough
+         * memory allocated to hold the file contents
+         */
+
+        if (cmd_record_index > (numCmds - 1)) {
+            numCmds *= 2;
+            resizeCmdRecord();
+        }
+    }
+
+    free(data.buffer);
+}
+
+/**
+ * Reads the history saved by writeHistToFile
+ * into _cmdHistory, one command per line.
+ *
+ * @param filename
+ * @param _cmdHistory The array of history
+ * commands to fill.
+ */
+void readHistoryFile(const char *filename, const struct interned_str **_cmdHistory) {
+
+    struct persist_data data;
+    const char *line, *end, *eol;
+    int cmdIndex = 0;
+    int status = loadPersisted(filename, "history", &data);
+
+    if (status == PERSIST_MISSING) {
+        printf("History File not found.  File will be created on exit.\n");
+        return;
+    } else if (status != PERSIST_OK) {
+        return;
+    }
+
+    line = data.payload;
+    end = data.payload + data.length;
+
+    // intern each line, without its newline,
+    // until the history buffer is full
+    while (line < end && cmdIndex < MAX_HISTORY) {
+        eol = memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            eol = end;
+        }
+
+        _cmdHistory[cmdIndex] = internString(line, eol - line);
+
+        cmdIndex++;
+        line = eol + 1;
+    }
+
+    free(data.buffer);
+}
+
+/**
+ * Makes sure _buf holds at least _need
+ * elements of _elemSize bytes, doubling
+ * *_cap as required.  Exits if memory
+ * runs out.
+ *
+ * @return the possibly moved buffer.
+ */
+void *growBuffer(void *_buf, size_t *_cap, size_t _need, size_t _elemSize) {
+    size_t cap = *_cap;
+
+    if (_need <= cap) {
+        return _buf;
+    }
+
+    if (cap == 0) {
+        cap = 16;
+    }
+    while (cap < _need) {
+        cap *= 2;
+    }
+
+    if ((_buf = realloc(_buf, cap * _elemSize)) == NULL) {
+        printf("\nOut of memory");
+        exit(1);
+    }
+
+    *_cap = cap;
+    return _buf;
+}
+
+/**
+ * Carves _size bytes out of the string
+ * arena.  Requests larger than a quarter
+ * block get a block of their own so the
+ * current block is not abandoned.
+ */
+void *arenaAlloc(size_t _size) {
+    struct arena_block *block = strArena.blocks;
+    void *ptr;
+
+    // keep every allocation aligned for struct interned_str
+    _size = (_size + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+
+    if (block == NULL || block->size - block->used < _size) {
+        size_t size = _size > ARENA_BLOCK_SIZE / 4 ? _size : ARENA_BLOCK_SIZE;
+
+        if ((block = malloc(sizeof(struct arena_block) + size)) == NULL) {
+            printf("\nOut of memory");
+            exit(1);
+        }
+        block->used = 0;
+        block->size = size;
+
+        if (size == _size && strArena.blocks != NULL) {
+            block->next = strArena.blocks->next;
+            strArena.blocks->next = block;
+        } else {
+            block->next = strArena.blocks;
+            strArena.blocks = block;
+        }
+    }
+
+    ptr = block->data + block->used;
+    block->used += _size;
+    strArena.bytesUsed += _size;
+
+    return ptr;
+}
+
+/**
+ * Returns the single stored copy of the
+ * _len bytes at _text, adding it to the
+ * string arena the first time it is seen.
+ * Equal commands therefore share a pointer
+ * and can be compared with ==.
+ */
+const struct interned_str *internString(const char *_text, size_t _len) {
+    struct interned_str *str, *next;
+    uint32_t hash = 2166136261u;  // FNV-1a
+    size_t i;
+
+    for (i = 0; i < _len; i++) {
+        hash = (hash ^ (unsigned char) _text[i]) * 16777619u;
+    }
+
+    // grow the table once it averages a string per bucket
+    if (strArena.numStrings >= strArena.numBuckets) {
+        size_t numBuckets = strArena.numBuckets ? strArena.numBuckets * 2 : INTERN_BUCKETS;
+        struct interned_str **buckets = calloc(numBuckets, sizeof(struct interned_str *));
+
+        if (buckets == NULL) {
+            printf("\nOut of memory");
+            exit(1);
+        }
+
+        for (i = 0; i < strArena.numBuckets; i++) {
+            for (str = strArena.buckets[i]; str != NULL; str = next) {
+                next = str->next;
+                str->next = buckets[str->hash & (numBuckets - 1)];
+                buckets[str->hash & (numBuckets - 1)] = str;
+            }
+        }
+
+        free(strArena.buckets);
+        strArena.buckets = buckets;
+        strArena.numBuckets = numBuckets;
+    }
+
+    for (str = strArena.buckets[hash & (strArena.numBuckets - 1)]; str != NULL; str = str->next) {
+        if (str->hash == hash && str->len == _len && memcmp(str->text, _text, _len) == 0) {
+            return str;
+        }
+    }
+
+    str = arenaAlloc(sizeof(struct interned_str) + _len + 1);
+    str->len = _len;
+    str->hash = hash;
+    memcpy(str->text, _text, _len);
+    str->text[_len] = '\0';
+
+    str->next = strArena.buckets[hash & (strArena.numBuckets - 1)];
+    strArena.buckets[hash & (strArena.numBuckets - 1)] = str;
+    strArena.numStrings++;
+
+    return str;
+}
+
+/**
+ * Releases every interned string.
+ */
+void freeStringArena(void) {
+    struct arena_block *block, *next;
+
+    for (block = strArena.blocks; block != NULL; block = next) {
+        next = block->next;
+        free(block);
+    }
+
+    free(strArena.buckets);
+    memset(&strArena, 0, sizeof(strArena));
+}
+
+/**
+ * Resizes the cmd_record ptr to
+ * the updated number of cmd_records
+ * (numCmds).  Does a deep copy,
+ * deletes, and then reinitializes the
+ * struct.
+ */
+
+void resizeCmdRecord(void) {
+
+    // temp struct pointer to copy
+    // the original into.
+    struct cmd_record **ptr_record_temp;
+    // allocate memory for temp struct
+    allocStruct(&ptr_record_temp, cmd_record_index);
+
+    int index;
+    // copy contents from global struct
+    // into the temp struct
+    for (index = 0; index < cmd_record_index; index++) {
+        ptr_record_temp[index]->count = pCmd_record[index]->count;
+        ptr_record_temp[index]->the_command = pCmd_record[index]->the_command;
+    }
+    // free the global, then reallocate
+    // with
+    deallocStruct(&pCmd_record, cmd_record_index);
+    allocStruct(&pCmd_record, numCmds);
+
+    // copy from temp back to global struct
+    for (index = 0; index < cmd_record_index; index++) {
+        pCmd_record[index]->count = ptr_record_temp[index]->count;
+        pCmd_record[index]->the_command = ptr_record_temp[index]->the_command;
+    }
+
+    // free the temp struct
+    deallocStruct(&ptr_record_temp, cmd_record_index);
+
+}
+
+/**
+ * Allocates the struct into memory
+ * using global variables.
+ *
+ */
+void allocStruct(struct cmd_record ***_pCmd_record, int _numCmds) {
+
+    //_pCmd_record = (struct cmd_record *) malloc(_numCmds * sizeof(struct cmd_record));
+    *_pCmd_record = malloc(_numCmds * sizeof(struct cmd_record));
+
+    int i;
+    for (i = 0; i < _numCmds; i++) {
+        *((*_pCmd_record) + i) = malloc(sizeof(struct cmd_record));
+    }
+}
+
+/**
+ * Reclaims the memory from the
+ * pCmd_record ** so it can be
+ * reused later in the program.
+ */
+
+void deallocStruct(struct cmd_record ***_pCmd_record, int _numCmds) {
+
+    int i;
+    // free each pointer in the array
+    for (i = 0; i < _numCmds; i++) {
+        free(*(*(_pCmd_record) + i));
+    }
+    // free the pointer to the array
+    free(*_pCmd_record);
+
+}
+
+/**
+ *
+ * @param _pCmd_record
+ * @param _theCommand   An interned command, so
+ *                      equal commands share a
+ *                      pointer.
+ */
+void updateOccurrence(const struct interned_str *_theCommand) {
+
+    // first we look to see if this command has occurred
+    // so we can update occurrence count and return
+    int i;
+
+    for (i = 0; i < cmd_record_index; i++) {
+        if (pCmd_record[i]->the_command == _theCommand) {
+            pCmd_record[i]->count++;
+            sortOccurrence();
+            return;
+        };
+    }
+
+    // if we continue, we need to move our index along
     // then check to resize, and if required we will
     // Then we add a new struct to our struct array
 
-    stpcpy(pCmd_record[cmd_record_index]->the_command, _theCommand);
+    pCmd_record[cmd_record_index]->the_command = _theCommand;
     pCmd_record[cmd_record_index]->count = 1;
 
     cmd_record_index++;
     // Check to see if we require more memory
     if (cmd_record_index > numCmds - 1) {
+        numCmds *= 2;
         resizeCmdRecord();
     }
 
@@ -704,17 +1551,18 @@ void sortOccurrence(void) {
             if (pCmd_record[j]->count > pCmd_record[i]->count) {
                 // store i into temp
                 temp->count = pCmd_record[i]->count;
-                strcpy(temp->the_command, pCmd_record[i]->the_command);
+                temp->the_command = pCmd_record[i]->the_command;
                 // store j into i
                 pCmd_record[i]->count = pCmd_record[j]->count;
-                strcpy(pCmd_record[i]->the_command, pCmd_record[j]->the_command);
+                pCmd_record[i]->the_command = pCmd_record[j]->the_command;
                 // store temp into j (i into j)
                 pCmd_record[j]->count = temp->count;
-                strcpy(pCmd_record[j]->the_command, temp->the_command);
+                pCmd_record[j]->the_command = temp->the_command;
             }
         }
     }
 
+    free(temp);
 
 }
 
@@ -731,13 +1579,9 @@ void printOccurrences() {
             break;
         }
 
-        int j;
-
         printf("\"");
 
-        for (j = 0; j < (strlen(pCmd_record[i]->the_command) - 1); j++) {
-            printf("%c", pCmd_record[i]->the_command[j]);
-        }
+        printCommand(pCmd_record[i]->the_command);
 
         if (pCmd_record[i]->count < 2) {
             printf("\"\t\t\t(%i Occurrence)\n", pCmd_record[i]->count);
@@ -746,3 +1590,751 @@ void printOccurrences() {
         }
     }
 }
+
+/**
+ * Copies the environment this shell was
+ * started with into shellEnv.
+ */
+void importEnvironment(void) {
+    char **entry;
+    char *eq;
+
+    for (entry = environ; entry != NULL && *entry != NULL; entry++) {
+        if ((eq = strchr(*entry, '=')) != NULL) {
+            setVariable(*entry, eq - *entry, eq + 1);
+        }
+    }
+
+    // the inherited environment is version 0
+    shellEnv.version = 0;
+    atomic_store(&metrics.envVersion, 0);
+}
+
+/**
+ * @return the index of the variable named by
+ * the _nameLen bytes at _name, or -1.
+ */
+int findVariable(const char *_name, size_t _nameLen) {
+    size_t i;
+
+    for (i = 0; i < shellEnv.count; i++) {
+        if (strncmp(shellEnv.entries[i], _name, _nameLen) == 0 && shellEnv.entries[i][_nameLen] == '=') {
+            return (int) i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Sets a variable, replacing any old value.
+ * Setting the value it already has is not
+ * a change and keeps the current snapshot.
+ *
+ * @return non zero if the environment changed.
+ */
+int setVariable(const char *_name, size_t _nameLen, const char *_value) {
+    size_t valueLen = strlen(_value);
+    char *entry = malloc(_nameLen + valueLen + 2);
+    int index = findVariable(_name, _nameLen);
+
+    if (entry == NULL) {
+        printf("\nOut of memory");
+        exit(1);
+    }
+
+    memcpy(entry, _name, _nameLen);
+    entry[_nameLen] = '=';
+    memcpy(entry + _nameLen + 1, _value, valueLen + 1);
+
+    if (index >= 0 && strcmp(shellEnv.entries[index], entry) == 0) {
+        free(entry);
+        return 0;
+    }
+
+    if (index >= 0) {
+        retireVariable(shellEnv.entries[index]);
+        shellEnv.entries[index] = entry;
+    } else {
+        shellEnv.entries = growBuffer(shellEnv.entries, &shellEnv.cap, shellEnv.count + 1, sizeof(char *));
+        shellEnv.entries[shellEnv.count++] = entry;
+    }
+
+    shellEnv.version++;
+    atomic_store(&metrics.envVersion, shellEnv.version);
+    atomic_store(&metrics.envVariables, shellEnv.count);
+
+    return 1;
+}
+
+/**
+ * Removes a variable, if it is set.
+ *
+ * @return non zero if the environment changed.
+ */
+int unsetVariable(const char *_name, size_t _nameLen) {
+    int index = findVariable(_name, _nameLen);
+
+    if (index < 0) {
+        return 0;
+    }
+
+    // keep the remaining variables in order
+    retireVariable(shellEnv.entries[index]);
+    memmove(shellEnv.entries + index, shellEnv.entries + index + 1,
+            sizeof(char *) * (shellEnv.count - index - 1));
+    shellEnv.count--;
+
+    shellEnv.version++;
+    atomic_store(&metrics.envVersion, shellEnv.version);
+    atomic_store(&metrics.envVariables, shellEnv.count);
+
+    return 1;
+}
+
+/**
+ * Drops an entry replaced or removed from
+ * shellEnv.  While a snapshot exists it may
+ * still point at the entry, so it is kept
+ * until that snapshot is rebuilt.
+ */
+void retireVariable(char *_entry) {
+    if (envSnapshot.envp == NULL) {
+        free(_entry);
+        return;
+    }
+
+    envSnapshot.retired = growBuffer(envSnapshot.retired, &envSnapshot.retiredCap,
+                                     envSnapshot.retiredCount + 1, sizeof(char *));
+    envSnapshot.retired[envSnapshot.retiredCount++] = _entry;
+}
+
+/**
+ * True if the _nameLen bytes at _name are
+ * letters, digits or '_' and do not start
+ * with a digit.
+ */
+int isVariableName(const char *_name, size_t _nameLen) {
+    size_t i;
+
+    if (_nameLen == 0 || isdigit((unsigned char) _name[0])) {
+        return 0;
+    }
+
+    for (i = 0; i < _nameLen; i++) {
+        if (!isalnum((unsigned char) _name[i]) && _name[i] != '_') {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * The export builtin.  Each argument is
+ * NAME=VALUE.  With no arguments, lists
+ * every variable.
+ */
+void runExport(char **_argv) {
+    size_t i;
+    char *eq;
+
+    if (_argv[1] == NULL) {
+        for (i = 0; i < shellEnv.count; i++) {
+            printf("%s\n", shellEnv.entries[i]);
+        }
+        return;
+    }
+
+    for (_argv++; *_argv != NULL; _argv++) {
+        eq = strchr(*_argv, '=');
+
+        if (eq == NULL || !isVariableName(*_argv, eq - *_argv)) {
+            printf("export: %s is not NAME=VALUE\n", *_argv);
+            continue;
+        }
+
+        setVariable(*_argv, eq - *_argv, eq + 1);
+    }
+}
+
+/**
+ * The unset builtin.  Removes each
+ * variable named.
+ */
+void runUnset(char **_argv) {
+    for (_argv++; *_argv != NULL; _argv++) {
+        if (!isVariableName(*_argv, strlen(*_argv))) {
+            printf("unset: %s is not a variable name\n", *_argv);
+            continue;
+        }
+
+        unsetVariable(*_argv, strlen(*_argv));
+    }
+}
+
+/**
+ * Returns the envp array for the next child.
+ *
+ * The array is only rebuilt when shellEnv.version
+ * has moved on since the last build; until then
+ * every launch shares it.  It is never modified
+ * once built, and the strings it points at are
+ * kept alive until it is replaced by the next
+ * rebuild, even if the variables change.
+ */
+char **currentEnvironment(void) {
+    uint64_t started;
+    size_t i;
+
+    if (envSnapshot.envp != NULL && envSnapshot.version == shellEnv.version) {
+        atomic_fetch_add(&metrics.envReuses, 1);
+        return envSnapshot.envp;
+    }
+
+    started = monotonicNs();
+
+    // entries are replaced, never edited in place,
+    // and retired ones outlive the snapshot using
+    // them, so the snapshot can point straight at them
+    free(envSnapshot.envp);
+    for (i = 0; i < envSnapshot.retiredCount; i++) {
+        free(envSnapshot.retired[i]);
+    }
+    envSnapshot.retiredCount = 0;
+
+    if ((envSnapshot.envp = malloc(sizeof(char *) * (shellEnv.count + 1))) == NULL) {
+        printf("\nOut of memory");
+        exit(1);
+    }
+
+    if (shellEnv.count > 0) {
+        memcpy(envSnapshot.envp, shellEnv.entries, sizeof(char *) * shellEnv.count);
+    }
+    envSnapshot.envp[shellEnv.count] = (char *) NULL;
+    envSnapshot.version = shellEnv.version;
+
+    atomic_fetch_add(&metrics.envRebuilds, 1);
+    atomic_fetch_add(&metrics.envRebuildNs, monotonicNs() - started);
+
+    return envSnapshot.envp;
+}
+
+/**
+ * Releases every variable and the snapshot.
+ */
+void freeEnvironment(void) {
+    size_t i;
+
+    for (i = 0; i < shellEnv.count; i++) {
+        free(shellEnv.entries[i]);
+    }
+
+    for (i = 0; i < envSnapshot.retiredCount; i++) {
+        free(envSnapshot.retired[i]);
+    }
+
+    free(shellEnv.entries);
+    free(envSnapshot.envp);
+    free(envSnapshot.retired);
+    memset(&shellEnv, 0, sizeof(shellEnv));
+    memset(&envSnapshot, 0, sizeof(envSnapshot));
+}
+
+/**
+ * Nanoseconds on a clock that never
+ * goes backwards, for timing spans.
+ */
+uint64_t monotonicNs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Forks and execs _argv[0] as a child process.
+ *
+ * A close-on-exec pipe tells the parent whether
+ * the exec worked: a successful exec closes it,
+ * a failed one writes errno to it first.  This
+ * times the spawn and counts exec failures
+ * without guessing from the exit status.
+ *
+ * @param _argv         NULL terminated arguments.
+ * @param _envp         The environment snapshot for the child.
+ * @param _execFailed   Set non zero if the exec failed.
+ * @return the child pid, or -1 if fork failed.
+ */
+pid_t spawnCommand(char **_argv, char **_envp, int *_execFailed) {
+    int execPipe[2] = {-1, -1};
+    int execErrno;
+    uint64_t started;
+    ssize_t got;
+    pid_t child_pid;
+
+    *_execFailed = 0;
+
+    if (pipe(execPipe) == 0) {
+        fcntl(execPipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(execPipe[1], F_SETFD, FD_CLOEXEC);
+    }
+
+    // flush before forking so the child does not
+    // inherit, and later repeat, buffered output
+    fflush(stdout);
+    started = monotonicNs();
+    child_pid = fork();
+
+    if (child_pid == 0) {
+        // execvp searches the child's own PATH
+        environ = _envp;
+        execvp(*_argv, _argv);
+        execErrno = errno;
+        if (execPipe[1] >= 0) {
+            write(execPipe[1], &execErrno, sizeof(execErrno));
+        }
+        printf("Unknown Command.\n");
+        exit(2);
+    }
+
+    if (execPipe[1] >= 0) {
+        close(execPipe[1]);
+    }
+
+    if (child_pid < 0) {
+        atomic_fetch_add(&metrics.forkFailures, 1);
+        printf("\nFork Failed\n");
+    } else if (execPipe[0] >= 0) {
+        // blocks until the exec happens or fails
+        do {
+            got = read(execPipe[0], &execErrno, sizeof(execErrno));
+        } while (got < 0 && errno == EINTR);
+
+        if (got == sizeof(execErrno)) {
+            *_execFailed = 1;
+            atomic_fetch_add(&metrics.execFailures, 1);
+        } else {
+            atomic_fetch_add(&metrics.commandsExecuted, 1);
+            metricsObserveSpawn(monotonicNs() - started);
+        }
+    } else {
+        atomic_fetch_add(&metrics.commandsExecuted, 1);
+    }
+
+    if (execPipe[0] >= 0) {
+        close(execPipe[0]);
+    }
+
+    return child_pid;
+}
+
+/**
+ * Adds one fork to exec latency
+ * to the spawn histogram.
+ */
+void metricsObserveSpawn(uint64_t _ns) {
+    int i;
+
+    for (i = 0; i < SPAWN_BUCKETS; i++) {
+        if (_ns <= SPAWN_BUCKET_BOUNDS[i] * 1e9) {
+            break;
+        }
+    }
+
+    atomic_fetch_add(&metrics.spawnBuckets[i], 1);
+    atomic_fetch_add(&metrics.spawnSumNs, _ns);
+}
+
+/**
+ * Records how long a load or save of one
+ * file took.  Only recorded timings are
+ * exported, so a save that has not happened
+ * yet never shows as taking no time.
+ */
+void metricsRecordPersist(int _file, int _op, uint64_t _ns) {
+    atomic_store(&metrics.persistNs[_file][_op], _ns);
+    atomic_store(&metrics.persistSeen[_file][_op], 1);
+}
+
+/**
+ * Publishes the sizes of the history,
+ * occurrence and interned string tables.
+ */
+void metricsUpdateTables(const struct interned_str **_cmdHistory) {
+    int i;
+
+    for (i = 0; i < MAX_HISTORY && *(_cmdHistory + i) != NULL; i++);
+
+    atomic_store(&metrics.historyEntries, i);
+    atomic_store(&metrics.occurrenceRecords, cmd_record_index);
+    atomic_store(&metrics.internedStrings, strArena.numStrings);
+    atomic_store(&metrics.internedBytes, strArena.bytesUsed);
+}
+
+/**
+ * Starts the metrics thread if METRICS_ENV
+ * names a socket path.  Any failure is
+ * reported and the shell carries on
+ * without metrics.
+ */
+void startMetricsServer(void) {
+    const char *pattern = getenv(METRICS_ENV);
+    char *path = metricsServer.addr.sun_path;
+    size_t used = 0, room = sizeof(metricsServer.addr.sun_path);
+
+    if (pattern == NULL || *pattern == '\0') {
+        return;
+    }
+
+    // expand %p to the pid so many shells can
+    // share one setting
+    for (; *pattern != '\0' && used < room; pattern++) {
+        if (pattern[0] == '%' && pattern[1] == 'p') {
+            used += snprintf(path + used, room - used, "%ld", (long) getpid());
+            pattern++;
+        } else {
+            path[used++] = *pattern;
+        }
+    }
+
+    if (used >= room) {
+        printf("Metrics socket path is too long.\n");
+        return;
+    }
+    path[used] = '\0';
+    metricsServer.addr.sun_family = AF_UNIX;
+
+    if (removeStaleSocket(path) != 0) {
+        return;
+    }
+
+    if ((metricsServer.listenFd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        printf("Unable to serve metrics: %s\n", strerror(errno));
+        return;
+    }
+
+    // children must not inherit the socket,
+    // and accept must never block the thread
+    fcntl(metricsServer.listenFd, F_SETFD, FD_CLOEXEC);
+    fcntl(metricsServer.listenFd, F_SETFL, O_NONBLOCK);
+
+    if (bind(metricsServer.listenFd, (struct sockaddr *) &metricsServer.addr, sizeof(metricsServer.addr)) != 0
+        || listen(metricsServer.listenFd, 16) != 0
+        || pipe(metricsServer.wakePipe) != 0) {
+        printf("Unable to serve metrics on %s: %s\n", path, strerror(errno));
+        close(metricsServer.listenFd);
+        metricsServer.listenFd = -1;
+        return;
+    }
+
+    fcntl(metricsServer.wakePipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(metricsServer.wakePipe[1], F_SETFD, FD_CLOEXEC);
+
+    if (pthread_create(&metricsServer.thread, NULL, metricsThread, NULL) != 0) {
+        printf("Unable to start the metrics thread.\n");
+        stopMetricsServer();
+        return;
+    }
+
+    metricsServer.running = 1;
+}
+
+/**
+ * Makes _path free to bind.  Only a socket
+ * left behind by a crashed shell, which
+ * refuses connections, is removed; anything
+ * else is reported and left alone.
+ *
+ * @return 0 if _path can be bound, -1 if not.
+ */
+int removeStaleSocket(const char *_path) {
+    struct stat st;
+    int probe, err;
+
+    if (lstat(_path, &st) != 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        printf("Unable to serve metrics on %s: %s\n", _path, strerror(errno));
+        return -1;
+    }
+
+    if (!S_ISSOCK(st.st_mode)) {
+        printf("Unable to serve metrics on %s: not a socket\n", _path);
+        return -1;
+    }
+
+    if ((probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        printf("Unable to serve metrics: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (connect(probe, (struct sockaddr *) &metricsServer.addr, sizeof(metricsServer.addr)) == 0) {
+        close(probe);
+        printf("Unable to serve metrics on %s: in use by another process\n", _path);
+        return -1;
+    }
+
+    err = errno;
+    close(probe);
+
+    if (err != ECONNREFUSED) {
+        printf("Unable to serve metrics on %s: %s\n", _path, strerror(err));
+        return -1;
+    }
+
+    unlink(_path);
+    return 0;
+}
+
+/**
+ * Stops the metrics thread, if running,
+ * and removes its socket.
+ */
+void stopMetricsServer(void) {
+    if (metricsServer.listenFd < 0) {
+        return;
+    }
+
+    if (metricsServer.running) {
+        write(metricsServer.wakePipe[1], "", 1);
+        pthread_join(metricsServer.thread, NULL);
+        metricsServer.running = 0;
+    }
+
+    close(metricsServer.wakePipe[0]);
+    close(metricsServer.wakePipe[1]);
+    close(metricsServer.listenFd);
+    unlink(metricsServer.addr.sun_path);
+    metricsServer.listenFd = -1;
+}
+
+/**
+ * Accepts scrapes until woken through
+ * metricsServer.wakePipe.  Runs apart
+ * from the prompt, so a slow or stuck
+ * client never delays a command.
+ */
+void *metricsThread(void *_arg) {
+    struct pollfd fds[2];
+    int client;
+
+    (void) _arg;
+
+    fds[0].fd = metricsServer.listenFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = metricsServer.wakePipe[0];
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (fds[1].revents != 0) {
+            break;
+        }
+
+        // children forked mid scrape must not
+        // inherit the connection
+        while ((client = accept4(metricsServer.listenFd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0) {
+            serveMetricsClient(client);
+            close(client);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Reads an HTTP request from _fd, giving
+ * up after METRICS_TIMEOUT_MS, and answers
+ * it with the current metrics.
+ */
+void serveMetricsClient(int _fd) {
+    static char request[METRICS_BUFFER], body[METRICS_BUFFER];
+    char header[128];
+    struct pollfd pfd = {_fd, POLLIN, 0};
+    const char *parts[2] = {header, body};
+    size_t used = 0, bodyLen, lengths[2], sent;
+    ssize_t got;
+    int headerLen, i;
+
+    // wait for the blank line ending the request
+    while (used < sizeof(request) - 1) {
+        if (poll(&pfd, 1, METRICS_TIMEOUT_MS) <= 0) {
+            return;
+        }
+
+        got = recv(_fd, request + used, sizeof(request) - 1 - used, 0);
+        if (got < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (got <= 0)
+            return;
+
+        used += got;
+        request[used] = '\0';
+
+        if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL) {
+            break;
+        }
+    }
+
+    if (strncmp(request, "GET ", 4) != 0) {
+        bodyLen = snprintf(body, sizeof(body), "Only GET is supported.\n");
+        headerLen = snprintf(header, sizeof(header),
+                             "HTTP/1.0 405 Method Not Allowed\r\nContent-Type: text/plain\r\n"
+                             "Content-Length: %zu\r\nConnection: close\r\n\r\n", bodyLen);
+    } else {
+        bodyLen = formatMetrics(body, sizeof(body));
+        headerLen = snprintf(header, sizeof(header),
+                             "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                             "Content-Length: %zu\r\nConnection: close\r\n\r\n", bodyLen);
+    }
+
+    // send it all, but a client that stops
+    // reading only loses its own response
+    lengths[0] = (size_t) headerLen;
+    lengths[1] = bodyLen;
+    pfd.events = POLLOUT;
+
+    for (i = 0; i < 2; i++) {
+        for (sent = 0; sent < lengths[i]; sent += got) {
+            if (poll(&pfd, 1, METRICS_TIMEOUT_MS) <= 0) {
+                return;
+            }
+
+            got = send(_fd, parts[i] + sent, lengths[i] - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (got < 0 && (errno == EINTR || errno == EAGAIN)) {
+                got = 0;
+                continue;
+            }
+            if (got < 0) {
+                return;
+            }
+        }
+    }
+}
+
+/**
+ * Writes every metric to _buf in the
+ * Prometheus text exposition format.
+ *
+ * @return the number of bytes written.
+ */
+size_t formatMetrics(char *_buf, size_t _size) {
+    static const char *files[2] = {"history", "occurrence"};
+    static const char *ops[2] = {"load", "save"};
+    unsigned long cumulative = 0;
+    size_t used = 0;
+    int i, j;
+
+    appendf(_buf, _size, &used,
+            "# HELP cmdline_commands_executed_total Commands started as child processes.\n"
+            "# TYPE cmdline_commands_executed_total counter\n"
+            "cmdline_commands_executed_total %lu\n", atomic_load(&metrics.commandsExecuted));
+    appendf(_buf, _size, &used,
+            "# HELP cmdline_commands_failed_total Commands that exited with a non zero status.\n"
+            "# TYPE cmdline_commands_failed_total counter\n"
+            "cmdline_commands_failed_total %lu\n", atomic_load(&metrics.commandsFailed));
+    appendf(_buf, _size, &used,
+            "# HELP cmdline_fork_failures_total Commands that could not be forked.\n"
+            "# TYPE cmdline_fork_failures_total counter\n"
+            "cmdline_fork_failures_total %lu\n", atomic_load(&metrics.forkFailures));
+    appendf(_buf, _size, &used,
+            "# HELP cmdline_exec_failures_total Commands that could not be exec'd (Unknown Command).\n"
+            "# TYPE cmdline_exec_failures_total counter\n"
+            "cmdline_exec_failures_total %lu\n", atomic_load(&metrics.execFailures));
+
+    appendf(_buf, _size, &used,
+            "# HELP cmdline_spawn_duration_seconds Time from fork to a successful exec.\n"
+            "# TYPE cmdline_spawn_duration_seconds histogram\n");
+    for (i = 0; i < SPAWN_BUCKETS; i++) {
+        cumulative += atomic_load(&metrics.spawnBuckets[i]);
+        appendf(_buf, _size, &used, "cmdline_spawn_duration_seconds_bucket{le=\"%g\"} %lu\n",
+                SPAWN_BUCKET_BOUNDS[i], cumulative);
+    }
+    cumulative += atomic_load(&metrics.spawnBuckets[SPAWN_BUCKETS]);
+    appendf(_buf, _size, &used,
+            "cmdline_spawn_duration_seconds_bucket{le=\"+Inf\"} %lu\n"
+            "cmdline_spawn_duration_seconds_sum %.9f\n"
+            "cmdline_spawn_duration_seconds_count %lu\n",
+            cumulative, atomic_load(&metrics.spawnSumNs) / 1e9, cumulative);
+
+    appendf(_buf, _size, &used,
+            "# HELP cmdline_history_entries Commands in the recent history buffer.\n"
+            "# TYPE cmdline_history_entries gauge\n"
+            "cmdline_history_entries %lu\n", atomic_load(&metrics.historyEntries));
+    appendf(_buf, _size, &used,
+            "# HELP cmdline_occurrence_records Distinct commands counted for mfu.\n"
+            "# TYPE cmdline_occurrence_records gauge\n"
+            "cmdline_occurrence_records %lu\n", atomic_load(&metrics.occurrenceRecords));
+    appendf(_buf, _size, &used,
+            "# HELP cmdline_interned_strings Distinct commands held in the string arena.\n"
+            "# TYPE cmdline_interned_strings gauge\n"
+            "cmdline_interned_strings %lu\n", atomic_load(&metrics.internedStrings));
+    appendf(_buf, _size, &used,
+            "# HELP cmdline_interned_bytes Bytes used in the string arena.\n"
+            "# TYPE cmdline_interned_bytes gauge\n"
+            "cmdline_interned_bytes %lu\n", atomic_load(&metrics.internedBytes));
+
+    appendf(_buf, _size, &used,
+            "# HELP cmdline_persist_duration_seconds Time of the last load or save of each file, once one has happened.\n"
+            "# TYPE cmdline_persist_duration_seconds gauge\n");
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < 2; j++) {
+            if (!atomic_load(&metrics.persistSeen[i][j])) {
+                continue;
+            }
+            appendf(_buf, _size, &used, "cmdline_persist_duration_seconds{file=\"%s\",op=\"%s\"} %.9f\n",
+                    files[i], ops[j], atomic_load(&metrics.persistNs[i][j]) / 1e9);
+        }
+    }
+
+    appendf(_buf, _size, &used,
+            "# HELP cmdline_env_snapshot_reuses_total Commands launched with an already built environment.\n"
+            "# TYPE cmdline_env_snapshot_reuses_total counter\n"
+            "cmdline_env_snapshot_reuses_total %lu\n", atomic_load(&metrics.envReuses));
+    appendf(_buf, _size, &used,
+            "# HELP cmdline_env_snapshot_rebuilds_total Environments rebuilt after a variable changed.\n"
+            "# TYPE cmdline_env_snapshot_rebuilds_total counter\n"
+            "cmdline_env_snapshot_rebuilds_total %lu\n", atomic_load(&metrics.envRebuilds));
+    appendf(_buf, _size, &used,
+            "# HELP cmdline_env_snapshot_rebuild_seconds_total Time spent rebuilding environments.\n"
+            "# TYPE cmdline_env_snapshot_rebuild_seconds_total counter\n"
+            "cmdline_env_snapshot_rebuild_seconds_total %.9f\n", atomic_load(&metrics.envRebuildNs) / 1e9);
+    appendf(_buf, _size, &used,
+            "# HELP cmdline_env_version Number of changes made to the shell variables.\n"
+            "# TYPE cmdline_env_version gauge\n"
+            "cmdline_env_version %lu\n", atomic_load(&metrics.envVersion));
+    appendf(_buf, _size, &used,
+            "# HELP cmdline_env_variables Variables passed to each command.\n"
+            "# TYPE cmdline_env_variables gauge\n"
+            "cmdline_env_variables %lu\n", atomic_load(&metrics.envVariables));
+
+    return used;
+}
+
+/**
+ * printf onto the end of _buf, stopping
+ * quietly once _size bytes are used.
+ */
+void appendf(char *_buf, size_t _size, size_t *_used, const char *_fmt, ...) {
+    va_list ap;
+    int n;
+
+    if (*_used >= _size) {
+        return;
+    }
+
+    va_start(ap, _fmt);
+    n = vsnprintf(_buf + *_used, _size - *_used, _fmt, ap);
+    va_end(ap);
+
+    if (n > 0) {
+        *_used += (size_t) n < _size - *_used ? (size_t) n : _size - *_used - 1;
+    }
+}